@@ -1,8 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 // #define NN_DEBUG 1
 
@@ -13,6 +29,8 @@
 #endif
 
 typedef void (*activationFunc)(bool derivative, float *inp, float *out);
+// called by backpropagate as soon as all params of a layer are updated
+typedef void (*layerDoneFunc)(void *ctx, int layer);
 
 typedef enum {
     fullyConnected,
@@ -32,6 +50,8 @@ typedef struct {
   baseLayer **nnLayer;
   float *lastLayerWeight; // replaces virtually necessary layer
   float *lastLayerBias; // replaces virtually necessary layer
+  layerDoneFunc onLayerDone;
+  void *onLayerDoneCtx;
 } neuralNet;
 
 /*
@@ -82,6 +102,8 @@ neuralNet createNet(baseLayer *layer[], int nLayer) {
   nn->nLayer = nLayer;
   nn->lastLayerWeight = (float*)malloc(nn->nnLayer[nLayer-1]->size * sizeof(float));
   nn->lastLayerBias = (float*)malloc(nn->nnLayer[nLayer-1]->size * sizeof(float));
+  nn->onLayerDone = 0;
+  nn->onLayerDoneCtx = 0;
 
   for (int i=0; i<nLayer; ++i) {
     setRandWeights(nn->nnLayer[i],nn->nnLayer[i]->size);
@@ -217,6 +239,10 @@ void backpropagate(neuralNet *net, float *input, float learningRate) {
       }
       NN_DEBUG_PRINT(("-----------------\n"));
     }
+    // lets the caller work on layer i while the remaining layers are computed
+    if (net->onLayerDone) {
+      net->onLayerDone(net->onLayerDoneCtx, i);
+    }
     NN_DEBUG_PRINT(("---------------------------------------------------\n"));
   }
   #ifdef NN_DEBUG
@@ -263,69 +289,1512 @@ void lsErrorCalc(neuralNet *net, float *input, float *error) {
 /*
 util functions
 */
-int trainDNN(neuralNet *net, int nPredict, const char pathToFile[], int iterations, float learningRate) {
+typedef struct {
+  float *samples; // nPredict values per sample
+  int nSamples;
+  int nPredict;
+} dataset;
+
+// reads groups of nPredict lines as samples, the last valFraction of the samples is held out for
+// validation (the data is a time series, a random split would leak the future into the training)
+int loadDataset(const char pathToFile[], int nPredict, float valFraction, dataset *train, dataset *val) {
   FILE *fp;
   char *line = 0;
-  int inpIt = 0;
+  size_t len = 0;
   int nLines = 0;
+  int capacity = 1024;
+  float *values = (float*)malloc(capacity * sizeof(float));
+
+  fp = fopen(pathToFile, "r");
+  if (fp == 0) {
+    free(values);
+    return 1;
+  }
+  while (getline(&line, &len, fp) != -1) {
+    if (nLines == capacity) {
+      float *grown = (float*)realloc(values, 2 * capacity * sizeof(float));
+      if (grown == 0) {
+        free(values);
+        free(line);
+        fclose(fp);
+        return 1;
+      }
+      values = grown;
+      capacity *= 2;
+    }
+    values[nLines++] = atof(line);
+  }
+  fclose(fp);
+  if (line) {
+    free(line);
+  }
+
+  int nSamples = nLines / nPredict;
+  int nVal = (int)(nSamples * valFraction);
+
+  train->samples = values;
+  train->nSamples = nSamples - nVal;
+  train->nPredict = nPredict;
+  val->samples = (float*)malloc((nVal * nPredict + 1) * sizeof(float));
+  memcpy(val->samples, values + train->nSamples * nPredict, nVal * nPredict * sizeof(float));
+  val->nSamples = nVal;
+  val->nPredict = nPredict;
+  return 0;
+}
+
+void freeDataset(dataset *ds) {
+  free(ds->samples);
+  ds->samples = 0;
+  ds->nSamples = 0;
+}
+
+int predictDNN(neuralNet *net, float *predictionSeq) {
+  feedForward(net, predictionSeq);
+  baseLayer *lastLayer = net->nnLayer[net->nLayer-1];
+
+  for (int i = 0; i < lastLayer->size; i++) {
+    printf("Prediction %i, node val: %f \n", i, lastLayer->nodes[i]);
+  }
+  return 0;
+}
+
+/*
+numa placement
+*/
+
+// the mempolicy syscalls are used directly so that no libnuma is required
+#ifndef MPOL_PREFERRED
+# define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+# define MPOL_MF_MOVE (1<<1)
+#endif
+
+#define NUMA_MAX_NODES 64
+
+typedef struct {
+  int nNodes;
+  int nodeId[NUMA_MAX_NODES]; // kernel node id of every node
+  int nCpus[NUMA_MAX_NODES];
+  int *cpus[NUMA_MAX_NODES]; // cpu ids of every node
+} numaTopo;
+
+// parses a sysfs cpu/ node list like "0-3,8,10-11", returns the number of ids written to ids
+int parseIdList(const char *list, int *ids, int maxIds) {
+  int n = 0;
+  int from, to;
+  char *end;
+
+  while (*list && *list != '\n') {
+    from = strtol(list, &end, 10);
+    if (end == list) {
+      break;
+    }
+    to = from;
+    if (*end == '-') {
+      list = end+1;
+      to = strtol(list, &end, 10);
+    }
+    for (int i = from; i <= to && n < maxIds; i++) {
+      ids[n++] = i;
+    }
+    list = *end == ',' ? end+1 : end;
+  }
+  return n;
+}
+
+// reads the node topology from sysfs, only cpus the process is allowed to run on are kept
+// (cpusets, taskset), falls back to a single node holding all allowed cpus
+void numaInit(numaTopo *topo) {
+  FILE *fp;
+  char *line = 0;
   size_t len = 0;
-  ssize_t read;
+  char path[64];
+  int maxCpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+  int nAllowed;
+  cpu_set_t allowed;
+
+  if (maxCpus < CPU_SETSIZE) {
+    maxCpus = CPU_SETSIZE;
+  }
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      CPU_SET(i, &allowed);
+    }
+  }
+
+  memset(topo, 0, sizeof(numaTopo));
+  fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp) {
+    if (getline(&line, &len, fp) != -1) {
+      topo->nNodes = parseIdList(line, topo->nodeId, NUMA_MAX_NODES);
+    }
+    fclose(fp);
+  }
+  for (int n = 0; n < topo->nNodes; n++) {
+    topo->cpus[n] = (int*)malloc(maxCpus * sizeof(int));
+    // the node masks passed to the kernel hold NUMA_MAX_NODES bits
+    if (topo->nodeId[n] >= NUMA_MAX_NODES) {
+      fprintf(stderr, "numa: ignoring node %d, only ids below %d are supported \n", topo->nodeId[n], NUMA_MAX_NODES);
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", topo->nodeId[n]);
+    fp = fopen(path, "r");
+    if (fp) {
+      if (getline(&line, &len, fp) != -1) {
+        nAllowed = 0;
+        int nCpus = parseIdList(line, topo->cpus[n], maxCpus);
+        for (int i = 0; i < nCpus; i++) {
+          if (topo->cpus[n][i] < CPU_SETSIZE && CPU_ISSET(topo->cpus[n][i], &allowed)) {
+            topo->cpus[n][nAllowed++] = topo->cpus[n][i];
+          }
+        }
+        topo->nCpus[n] = nAllowed;
+      }
+      fclose(fp);
+    }
+  }
+  // memory only nodes and nodes without allowed cpus cannot run threads
+  for (int n = 0; n < topo->nNodes; n++) {
+    if (topo->nCpus[n] == 0) {
+      free(topo->cpus[n]);
+      topo->nNodes--;
+      for (int m = n; m < topo->nNodes; m++) {
+        topo->nodeId[m] = topo->nodeId[m+1];
+        topo->nCpus[m] = topo->nCpus[m+1];
+        topo->cpus[m] = topo->cpus[m+1];
+      }
+      n--;
+    }
+  }
+  if (topo->nNodes == 0) {
+    topo->nNodes = 1;
+    topo->nodeId[0] = 0;
+    topo->cpus[0] = (int*)malloc(CPU_SETSIZE * sizeof(int));
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &allowed)) {
+        topo->cpus[0][topo->nCpus[0]++] = i;
+      }
+    }
+  }
+  if (line) {
+    free(line);
+  }
+}
+
+void numaFree(numaTopo *topo) {
+  for (int n = 0; n < topo->nNodes; n++) {
+    free(topo->cpus[n]);
+  }
+}
+
+// pins the calling thread to a core of node (core < 0 allows the whole node) and
+// makes the node the preferred one for all memory the thread touches first
+// both are attempted independently, a failure is reported and returns 1
+int numaPinThread(numaTopo *topo, int node, int core) {
+  cpu_set_t set;
+  unsigned long mask[NUMA_MAX_NODES / (8*sizeof(unsigned long))] = {0};
+  int id = topo->nodeId[node];
+  int rc = 0;
+
+  CPU_ZERO(&set);
+  if (core < 0) {
+    for (int i = 0; i < topo->nCpus[node]; i++) {
+      CPU_SET(topo->cpus[node][i], &set);
+    }
+  } else {
+    CPU_SET(topo->cpus[node][core % topo->nCpus[node]], &set);
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    fprintf(stderr, "numa: could not pin thread to node %d \n", id);
+    rc = 1;
+  }
+
+  mask[id / (8*sizeof(unsigned long))] |= 1UL << (id % (8*sizeof(unsigned long)));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES+1)) {
+    fprintf(stderr, "numa: could not prefer node %d for memory (%s) \n", id, strerror(errno));
+    rc = 1;
+  }
+  return rc;
+}
+
+// allocates n floats on node (node < 0 is a plain malloc), the buffer is page aligned and
+// padded to full pages so that the policy does not affect any live neighbouring allocation
+// the node is only preferred: a full node falls back to another one, and the pages keep
+// nothing stronger than a preference once free hands them back to the heap
+// if mbind fails the pages are placed by the first touch of the calling thread, which
+// therefore should run on node
+float *numaAlloc(numaTopo *topo, size_t n, int node) {
+  void *buf;
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t len = (n * sizeof(float) + pageSize - 1) / pageSize * pageSize;
+  unsigned long mask[NUMA_MAX_NODES / (8*sizeof(unsigned long))] = {0};
+
+  if (node < 0 || topo == 0) {
+    return (float*)malloc(n * sizeof(float));
+  }
+  if (len == 0) {
+    len = pageSize;
+  }
+  if (posix_memalign(&buf, pageSize, len)) {
+    return 0;
+  }
+  int id = topo->nodeId[node];
+  mask[id / (8*sizeof(unsigned long))] |= 1UL << (id % (8*sizeof(unsigned long)));
+  if (syscall(SYS_mbind, buf, len, MPOL_PREFERRED, mask, NUMA_MAX_NODES+1, MPOL_MF_MOVE)) {
+    fprintf(stderr, "numa: could not bind memory to node %d (%s) \n", id, strerror(errno));
+  }
+  memset(buf, 0, len);
+  return (float*)buf;
+}
+
+// replaces buf by a copy on node
+void numaMoveBuf(numaTopo *topo, float **buf, size_t n, int node) {
+  float *moved = numaAlloc(topo, n, node);
+  if (moved == 0) {
+    return;
+  }
+  memcpy(moved, *buf, n * sizeof(float));
+  free(*buf);
+  *buf = moved;
+}
+
+// moves all params and activations of net to node
+void numaMoveNet(numaTopo *topo, neuralNet *net, int node) {
+  for (int l = 0; l < net->nLayer; l++) {
+    numaMoveBuf(topo, &net->nnLayer[l]->weights, net->nnLayer[l]->size, node);
+    numaMoveBuf(topo, &net->nnLayer[l]->bias, net->nnLayer[l]->size, node);
+    numaMoveBuf(topo, &net->nnLayer[l]->nodes, net->nnLayer[l]->size, node);
+  }
+  numaMoveBuf(topo, &net->lastLayerWeight, net->nnLayer[net->nLayer-1]->size, node);
+  numaMoveBuf(topo, &net->lastLayerBias, net->nnLayer[net->nLayer-1]->size, node);
+}
+
+// also releases a partially built replica, nnLayer is 0 afterwards
+void numaFreeReplica(neuralNet *replica, bool shareParams) {
+  if (replica->nnLayer == 0) {
+    return;
+  }
+  for (int l = 0; l < replica->nLayer; l++) {
+    if (replica->nnLayer[l] == 0) {
+      continue;
+    }
+    free(replica->nnLayer[l]->nodes);
+    if (!shareParams) {
+      free(replica->nnLayer[l]->weights);
+      free(replica->nnLayer[l]->bias);
+    }
+    free(replica->nnLayer[l]);
+  }
+  if (!shareParams) {
+    free(replica->lastLayerWeight);
+    free(replica->lastLayerBias);
+  }
+  free(replica->nnLayer);
+  replica->nnLayer = 0;
+}
+
+// copy of net on node, if shareParams is set only the activations are copied and
+// the read only params are shared with net (for threads using the replica of their node)
+// nnLayer of the replica is 0 if an allocation failed
+neuralNet numaReplicateNet(numaTopo *topo, neuralNet *net, int node, bool shareParams) {
+  neuralNet replica = *net;
+  bool failed = false;
+  baseLayer *layer;
+  int size;
+
+  replica.onLayerDone = 0;
+  replica.onLayerDoneCtx = 0;
+  if (!shareParams) {
+    replica.lastLayerWeight = 0;
+    replica.lastLayerBias = 0;
+  }
+  replica.nnLayer = (baseLayer**)calloc(net->nLayer, sizeof(baseLayer*));
+  if (replica.nnLayer == 0) {
+    return replica;
+  }
+  for (int l = 0; l < net->nLayer && !failed; l++) {
+    size = net->nnLayer[l]->size;
+    layer = (baseLayer*)malloc(sizeof(baseLayer));
+    if (layer == 0) {
+      failed = true;
+      break;
+    }
+    *layer = *net->nnLayer[l];
+    layer->nodes = numaAlloc(topo, size, node);
+    if (!shareParams) {
+      layer->weights = numaAlloc(topo, size, node);
+      layer->bias = numaAlloc(topo, size, node);
+    }
+    replica.nnLayer[l] = layer;
+    if (layer->nodes == 0 || layer->weights == 0 || layer->bias == 0) {
+      failed = true;
+      break;
+    }
+    if (!shareParams) {
+      memcpy(layer->weights, net->nnLayer[l]->weights, size * sizeof(float));
+      memcpy(layer->bias, net->nnLayer[l]->bias, size * sizeof(float));
+    }
+  }
+  if (!shareParams && !failed) {
+    size = net->nnLayer[net->nLayer-1]->size;
+    replica.lastLayerWeight = numaAlloc(topo, size, node);
+    replica.lastLayerBias = numaAlloc(topo, size, node);
+    failed = replica.lastLayerWeight == 0 || replica.lastLayerBias == 0;
+    if (!failed) {
+      memcpy(replica.lastLayerWeight, net->lastLayerWeight, size * sizeof(float));
+      memcpy(replica.lastLayerBias, net->lastLayerBias, size * sizeof(float));
+    }
+  }
+  if (failed) {
+    numaFreeReplica(&replica, shareParams);
+  }
+  return replica;
+}
+
+typedef struct {
+  numaTopo *topo;
+  int node;
+  neuralNet *net;
+  neuralNet *replica;
+} numaReplicateJob;
+
+// builds the replica from a thread on the node, so that the pages end up there even without mbind
+void *numaReplicateLoop(void *arg) {
+  numaReplicateJob *job = (numaReplicateJob*)arg;
+  numaPinThread(job->topo, job->node, -1);
+  *job->replica = numaReplicateNet(job->topo, job->net, job->node, false);
+  return 0;
+}
+
+typedef struct {
+  numaTopo *topo;
+  int node;
+  int core;
+  neuralNet *nodeReplica;
+  float *predictionSeqs; // nPredict values per sequence
+  float *predictions; // size of the last layer values per sequence
+  int nPredict;
+  int from;
+  int to;
+  bool failed;
+} numaPredictJob;
+
+void *numaPredictLoop(void *arg) {
+  numaPredictJob *job = (numaPredictJob*)arg;
+  numaPinThread(job->topo, job->node, job->core);
+
+  // activations are thread local, the params are the ones of the node replica
+  neuralNet net = numaReplicateNet(job->topo, job->nodeReplica, job->node, true);
+  if (net.nnLayer == 0) {
+    job->failed = true;
+    return 0;
+  }
+  int outSize = net.nnLayer[net.nLayer-1]->size;
+
+  for (int s = job->from; s < job->to; s++) {
+    feedForward(&net, job->predictionSeqs + s * job->nPredict);
+    memcpy(job->predictions + s * outSize, net.nnLayer[net.nLayer-1]->nodes, outSize * sizeof(float));
+  }
+  numaFreeReplica(&net, true);
+  return 0;
+}
+
+// predicts nSeq sequences with one thread per core, every node reads the params from its own replica
+int predictDNNNuma(neuralNet *net, numaTopo *topo, float *predictionSeqs, int nSeq, int nPredict) {
+  int nThreads = 0;
+  int outSize = net->nnLayer[net->nLayer-1]->size;
+  int t = 0;
+
+  for (int n = 0; n < topo->nNodes; n++) {
+    nThreads += topo->nCpus[n];
+  }
+  if (nThreads > nSeq) {
+    nThreads = nSeq;
+  }
+  if (nThreads == 0) {
+    return 0;
+  }
+
+  neuralNet *replicas = (neuralNet*)malloc(topo->nNodes * sizeof(neuralNet));
+  numaPredictJob *jobs = (numaPredictJob*)malloc(nThreads * sizeof(numaPredictJob));
+  pthread_t *threads = (pthread_t*)malloc(nThreads * sizeof(pthread_t));
+  float *predictions = (float*)malloc(nSeq * outSize * sizeof(float));
+  numaReplicateJob *replicateJobs = (numaReplicateJob*)malloc(topo->nNodes * sizeof(numaReplicateJob));
+  pthread_t *replicateThreads = (pthread_t*)malloc(topo->nNodes * sizeof(pthread_t));
+  int nReplicated = 0;
+
+  while (nReplicated < topo->nNodes) {
+    replicateJobs[nReplicated].topo = topo;
+    replicateJobs[nReplicated].node = nReplicated;
+    replicateJobs[nReplicated].net = net;
+    replicateJobs[nReplicated].replica = &replicas[nReplicated];
+    if (pthread_create(&replicateThreads[nReplicated], 0, numaReplicateLoop, &replicateJobs[nReplicated])) {
+      break;
+    }
+    nReplicated++;
+  }
+  for (int n = 0; n < nReplicated; n++) {
+    pthread_join(replicateThreads[n], 0);
+  }
+  free(replicateJobs);
+  free(replicateThreads);
+  bool replicated = nReplicated == topo->nNodes;
+  for (int n = 0; n < nReplicated; n++) {
+    replicated = replicated && replicas[n].nnLayer != 0;
+  }
+  if (!replicated) {
+    for (int n = 0; n < nReplicated; n++) {
+      numaFreeReplica(&replicas[n], false);
+    }
+    free(replicas);
+    free(jobs);
+    free(threads);
+    free(predictions);
+    return 1;
+  }
+
+  // distributing the threads over the nodes round robin
+  for (int c = 0; t < nThreads; c++) {
+    for (int n = 0; n < topo->nNodes && t < nThreads; n++) {
+      if (c >= topo->nCpus[n]) {
+        continue;
+      }
+      jobs[t].topo = topo;
+      jobs[t].node = n;
+      jobs[t].core = c;
+      jobs[t].nodeReplica = &replicas[n];
+      jobs[t].predictionSeqs = predictionSeqs;
+      jobs[t].predictions = predictions;
+      jobs[t].nPredict = nPredict;
+      jobs[t].from = t * nSeq / nThreads;
+      jobs[t].to = (t+1) * nSeq / nThreads;
+      jobs[t].failed = false;
+      t++;
+    }
+  }
+  int nStarted = 0;
+  while (nStarted < nThreads && pthread_create(&threads[nStarted], 0, numaPredictLoop, &jobs[nStarted]) == 0) {
+    nStarted++;
+  }
+  bool predicted = nStarted == nThreads;
+  for (t = 0; t < nStarted; t++) {
+    pthread_join(threads[t], 0);
+    predicted = predicted && !jobs[t].failed;
+  }
+
+  for (int s = 0; s < nSeq && predicted; s++) {
+    for (int i = 0; i < outSize; i++) {
+      printf("Sequence %i, prediction %i, node val: %f \n", s, i, predictions[s * outSize + i]);
+    }
+  }
+
+  for (int n = 0; n < topo->nNodes; n++) {
+    numaFreeReplica(&replicas[n], false);
+  }
+  free(replicas);
+  free(jobs);
+  free(threads);
+  free(predictions);
+  return predicted ? 0 : 1;
+}
+
+/*
+async evaluation
+*/
+
+// evaluates the validation loss on its own thread while the training continues,
+// the training thread only copies its params into the pending buffer which is then
+// swapped with the evaluated one (double buffering)
+typedef struct {
+  dataset *val;
+  int patience; // iterations without improvement until the training is stopped
+
+  neuralNet pending; // latest published params
+  neuralNet evaluated; // params the evaluator thread is working on
+  neuralNet best;
+  int pendingIteration; // -1 if nothing is pending
+  bool busy;
+  bool quit;
+
+  float bestErr;
+  int bestIteration; // -1 until the first evaluation finished
+  int lastIteration; // -1 until the first evaluation finished
+  float lastErr;
+  bool stopTraining;
 
-  float *inp = (float*)malloc(nPredict*sizeof(float));
+  numaTopo *topo;
+  int numaNode;
+  int numaCore;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} asyncEvaluator;
+
+// copies all params, the activations of dst are left untouched
+void copyNetParams(neuralNet *dst, neuralNet *src) {
+  int size;
+  for (int l = 0; l < src->nLayer; l++) {
+    size = src->nnLayer[l]->size;
+    memcpy(dst->nnLayer[l]->weights, src->nnLayer[l]->weights, size * sizeof(float));
+    memcpy(dst->nnLayer[l]->bias, src->nnLayer[l]->bias, size * sizeof(float));
+  }
+  size = src->nnLayer[src->nLayer-1]->size;
+  memcpy(dst->lastLayerWeight, src->lastLayerWeight, size * sizeof(float));
+  memcpy(dst->lastLayerBias, src->lastLayerBias, size * sizeof(float));
+}
+
+// same error as during the training, non finite sample errors are skipped
+float evalErrCalc(neuralNet *net, dataset *ds) {
   float error = 0;
   float meanErr = 0;
 
-  printf("mean Err: ");
-  for (int i = 0; i < iterations; i++) {
-    fp = fopen(pathToFile, "r");
-    if (fp == 0) {
-     return 1;
+  for (int s = 0; s < ds->nSamples; s++) {
+    feedForward(net, ds->samples + s * ds->nPredict);
+    lsErrorCalc(net, ds->samples + s * ds->nPredict, &error);
+    if (isfinite(error)) {
+      meanErr += error;
     }
-    while ((read = getline(&line, &len, fp)) != -1) {
-      if (inpIt == nPredict) {
+  }
+  return meanErr / ds->nSamples;
+}
 
-        backpropagate(net, inp, learningRate);
-        lsErrorCalc(net, inp, &error);
+void *evalLoop(void *arg) {
+  asyncEvaluator *eval = (asyncEvaluator*)arg;
+  neuralNet tmp;
+  int iteration;
+  float err;
 
-        if (isfinite(error)) {
-          meanErr += error;
-        }
-        nLines++;
-        inpIt = 0;
+  if (eval->topo) {
+    numaPinThread(eval->topo, eval->numaNode, eval->numaCore);
+  }
+
+  pthread_mutex_lock(&eval->lock);
+  while (true) {
+    while (!eval->quit && eval->pendingIteration < 0) {
+      pthread_cond_wait(&eval->cond, &eval->lock);
+    }
+    if (eval->pendingIteration < 0) {
+      break;
+    }
+    tmp = eval->pending;
+    eval->pending = eval->evaluated;
+    eval->evaluated = tmp;
+    iteration = eval->pendingIteration;
+    eval->pendingIteration = -1;
+    eval->busy = true;
+    pthread_mutex_unlock(&eval->lock);
+
+    err = evalErrCalc(&eval->evaluated, eval->val);
+
+    pthread_mutex_lock(&eval->lock);
+    if (eval->bestIteration < 0 || (isfinite(err) && (!isfinite(eval->bestErr) || err < eval->bestErr))) {
+      eval->bestErr = err;
+      eval->bestIteration = iteration;
+      copyNetParams(&eval->best, &eval->evaluated);
+    }
+    eval->lastIteration = iteration;
+    eval->lastErr = err;
+    if (iteration - eval->bestIteration >= eval->patience) {
+      eval->stopTraining = true;
+    }
+    eval->busy = false;
+    pthread_cond_broadcast(&eval->cond);
+  }
+  pthread_mutex_unlock(&eval->lock);
+  return 0;
+}
+
+// the evaluator thread is pinned to numaCore of numaNode if topo is set
+int evalInit(asyncEvaluator *eval, neuralNet *net, dataset *val, int patience, numaTopo *topo, int numaNode, int numaCore) {
+  int node = topo ? numaNode : -1;
+
+  memset(eval, 0, sizeof(asyncEvaluator));
+  eval->val = val;
+  eval->patience = patience;
+  eval->pending = numaReplicateNet(topo, net, node, false);
+  eval->evaluated = numaReplicateNet(topo, net, node, false);
+  eval->best = numaReplicateNet(topo, net, node, false);
+  if (eval->pending.nnLayer == 0 || eval->evaluated.nnLayer == 0 || eval->best.nnLayer == 0) {
+    numaFreeReplica(&eval->pending, false);
+    numaFreeReplica(&eval->evaluated, false);
+    numaFreeReplica(&eval->best, false);
+    return 1;
+  }
+  eval->pendingIteration = -1;
+  eval->bestIteration = -1;
+  eval->lastIteration = -1;
+  eval->topo = topo;
+  eval->numaNode = numaNode;
+  eval->numaCore = numaCore;
+
+  pthread_mutex_init(&eval->lock, 0);
+  pthread_cond_init(&eval->cond, 0);
+  if (pthread_create(&eval->thread, 0, evalLoop, eval)) {
+    pthread_mutex_destroy(&eval->lock);
+    pthread_cond_destroy(&eval->cond);
+    numaFreeReplica(&eval->pending, false);
+    numaFreeReplica(&eval->evaluated, false);
+    numaFreeReplica(&eval->best, false);
+    return 1;
+  }
+  return 0;
+}
+
+// hands the params of net after the given iteration to the evaluator and returns
+// immediately, a not yet evaluated older snapshot is replaced
+// valIteration/ valErr are set to the latest finished evaluation (valIteration -1 if there is none yet)
+// returns true if the training should stop
+bool evalPublish(asyncEvaluator *eval, neuralNet *net, int iteration, int *valIteration, float *valErr) {
+  bool stop;
+
+  pthread_mutex_lock(&eval->lock);
+  copyNetParams(&eval->pending, net);
+  eval->pendingIteration = iteration;
+  stop = eval->stopTraining;
+  *valIteration = eval->lastIteration;
+  *valErr = eval->lastErr;
+  pthread_cond_broadcast(&eval->cond);
+  pthread_mutex_unlock(&eval->lock);
+  return stop;
+}
+
+// waits for the last published params to be evaluated and restores the best params into net
+void evalFinish(asyncEvaluator *eval, neuralNet *net) {
+  pthread_mutex_lock(&eval->lock);
+  while (eval->pendingIteration >= 0 || eval->busy) {
+    pthread_cond_wait(&eval->cond, &eval->lock);
+  }
+  pthread_mutex_unlock(&eval->lock);
+
+  if (eval->lastIteration >= 0) {
+    printf("val Err: %f (iteration %i) \n", eval->lastErr, eval->lastIteration);
+  }
+  if (eval->bestIteration >= 0) {
+    copyNetParams(net, &eval->best);
+    printf("best val Err: %f (iteration %i) \n", eval->bestErr, eval->bestIteration);
+  }
+}
+
+void evalFree(asyncEvaluator *eval) {
+  pthread_mutex_lock(&eval->lock);
+  eval->quit = true;
+  pthread_cond_broadcast(&eval->cond);
+  pthread_mutex_unlock(&eval->lock);
+  pthread_join(eval->thread, 0);
+  pthread_mutex_destroy(&eval->lock);
+  pthread_cond_destroy(&eval->cond);
+
+  numaFreeReplica(&eval->pending, false);
+  numaFreeReplica(&eval->evaluated, false);
+  numaFreeReplica(&eval->best, false);
+}
+
+// the validation error belongs to the latest finished evaluation, which lags behind the training
+void printIterationErr(int iteration, float meanErr, bool evaluate, int valIteration, float valErr) {
+  printf("iteration %i mean Err: %f", iteration, meanErr);
+  if (evaluate && valIteration >= 0) {
+    printf(", val Err: %f (iteration %i)", valErr, valIteration);
+  }
+  printf(" \n");
+  fflush(stdout);
+}
+
+// the last valFraction of the samples is validated by an asyncEvaluator after every iteration,
+// the training stops after patience iterations without improvement and net ends up with the best params
+// if topo is set the evaluator runs on the last core of node 0
+int trainDNN(neuralNet *net, int nPredict, const char pathToFile[], int iterations, float learningRate, float valFraction, int patience, numaTopo *topo) {
+  dataset train, val;
+  asyncEvaluator eval;
+  float *inp;
+  float error = 0;
+  float meanErr = 0;
+  int valIteration = -1;
+  float valErr = 0;
+
+  if (loadDataset(pathToFile, nPredict, valFraction, &train, &val)) {
+    return 1;
+  }
+  bool evaluate = val.nSamples > 0;
+  if (train.nSamples == 0 || (evaluate && evalInit(&eval, net, &val, patience, topo, 0, topo ? topo->nCpus[0]-1 : 0))) {
+    freeDataset(&train);
+    freeDataset(&val);
+    return 1;
+  }
+
+  for (int i = 0; i < iterations; i++) {
+    for (int s = 0; s < train.nSamples; s++) {
+      inp = train.samples + s * nPredict;
+
+      backpropagate(net, inp, learningRate);
+      lsErrorCalc(net, inp, &error);
+
+      if (isfinite(error)) {
+        meanErr += error;
       }
-      inp[inpIt] = atof(line);
-      inpIt++;
     }
-    meanErr = meanErr/nLines;
-    printf("%f,", meanErr);
-    nLines = 0;
+    meanErr = meanErr/train.nSamples;
+
+    // the validation of this iteration runs while the next one is trained
+    bool stop = evaluate && evalPublish(&eval, net, i, &valIteration, &valErr);
+    printIterationErr(i, meanErr, evaluate, valIteration, valErr);
     meanErr = 0;
+    if (stop) {
+      printf("early stop after iteration %i \n", i);
+      break;
+    }
+  }
 
-    fclose(fp);
+  if (evaluate) {
+    evalFinish(&eval, net);
+    evalFree(&eval);
   }
-  printf("\n");
-  if (line) {
-   free(line);
+  freeDataset(&train);
+  freeDataset(&val);
+  return 0;
+}
+
+/*
+distributed data parallel training
+*/
+
+// every rank trains on its own shard of the samples, the param updates of syncInterval
+// local steps are averaged with a ring all-reduce (periodic model averaging, a per
+// sample all-reduce is bound by the socket latency for a net of this size)
+// the updates are packed into buckets of at least DIST_BUCKET_SIZE floats in backward
+// layer order, a bucket is reduced on the comm thread as soon as backpropagate is done
+// with all of its layers, so large nets overlap the reduction with the remaining layers
+#define DIST_BUCKET_SIZE 65536
+// how long the ring setup waits for the neighbours
+#define DIST_CONNECT_TIMEOUT_MS 60000
+// first values sent on every connection, followed by the rank and the worldSize of the sender
+#define DIST_MAGIC 0x564e4e31
+
+typedef struct {
+  int rank;
+  int worldSize;
+  int syncInterval;
+  int sendFd; // connection to rank+1
+  int recvFd; // connection from rank-1
+  char unixPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  numaTopo *topo; // 0 if the rank is not numa placed
+  int numaNode;
+
+  neuralNet *net;
+  int step; // local steps since the last all-reduce
+  int nParams;
+  int *offset; // of the params of every layer in snapshot/ delta, last layer first
+  float *snapshot; // params after the last all-reduce
+  float *delta; // param updates since the last all-reduce, reduced in place
+  float *scratch;
+
+  int nBuckets;
+  int *bucketOf; // bucket of every layer
+  int *bucketStart;
+  int *bucketEnd;
+  int *bucketLayers; // number of layers in every bucket
+  int *bucketPending; // layers of every bucket backpropagate is not done with in this step
+
+  pthread_t commThread;
+  bool commStarted;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int *queue; // buckets posted for reduction
+  int nQueued;
+  int nReduced;
+  bool stop;
+  int err;
+} distCtx;
+
+// the last layer is represented by lastLayerWeight/ lastLayerBias
+void distLayerParams(neuralNet *net, int l, float **weights, float **bias) {
+  if (l == net->nLayer-1) {
+    *weights = net->lastLayerWeight;
+    *bias = net->lastLayerBias;
+  } else {
+    *weights = net->nnLayer[l]->weights;
+    *bias = net->nnLayer[l]->bias;
+  }
+}
+
+// sends and receives at the same time so that the ring cannot deadlock on full socket buffers
+// fails if neither side makes progress for timeoutMs (-1 waits forever)
+int sendRecvAll(int sendFd, const char *sendBuf, size_t sendLen, int recvFd, char *recvBuf, size_t recvLen, int timeoutMs) {
+  size_t sent = 0;
+  size_t received = 0;
+  ssize_t rc;
+
+  while (sent < sendLen || received < recvLen) {
+    struct pollfd pfd[2];
+    int nFd = 0;
+    int sendIdx = -1;
+    int recvIdx = -1;
+
+    if (sent < sendLen) {
+      pfd[nFd].fd = sendFd;
+      pfd[nFd].events = POLLOUT;
+      sendIdx = nFd++;
+    }
+    if (received < recvLen) {
+      pfd[nFd].fd = recvFd;
+      pfd[nFd].events = POLLIN;
+      recvIdx = nFd++;
+    }
+    int nReady = poll(pfd, nFd, timeoutMs);
+    if (nReady < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    if (nReady == 0) {
+      return 1;
+    }
+    if (sendIdx >= 0 && pfd[sendIdx].revents) {
+      rc = send(sendFd, sendBuf + sent, sendLen - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return 1;
+      }
+      if (rc > 0) {
+        sent += rc;
+      }
+    }
+    if (recvIdx >= 0 && pfd[recvIdx].revents) {
+      rc = recv(recvFd, recvBuf + received, recvLen - received, MSG_DONTWAIT);
+      if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return 1;
+      }
+      if (rc > 0) {
+        received += rc;
+      }
+    }
   }
-  free(inp);
   return 0;
 }
 
-int predictDNN(neuralNet *net, float *predictionSeq) {
-  feedForward(net, predictionSeq);
-  baseLayer *lastLayer = net->nnLayer[net->nLayer-1];
+// sums buf over all ranks (reduce-scatter followed by all-gather)
+// every chunk is reduced on exactly one rank, so all ranks end up with identical values
+int ringAllReduce(distCtx *ctx, float *buf, int n) {
+  int N = ctx->worldSize;
+  int sendC, recvC, sendOff, recvOff, recvLen;
 
-  for (int i = 0; i < lastLayer->size; i++) {
-    printf("Prediction %i, node val: %f \n", i, lastLayer->nodes[i]);
+  for (int s = 0; s < 2*(N-1); s++) {
+    // both phases pass chunk rank-s on to the right neighbour
+    sendC = (ctx->rank - s + 2*N) % N;
+    recvC = (ctx->rank - s - 1 + 2*N) % N;
+    sendOff = sendC * n / N;
+    recvOff = recvC * n / N;
+    recvLen = (recvC+1) * n / N - recvOff;
+
+    if (s < N-1) {
+      if (sendRecvAll(ctx->sendFd, (char*)(buf + sendOff), ((sendC+1) * n / N - sendOff) * sizeof(float),
+                      ctx->recvFd, (char*)ctx->scratch, recvLen * sizeof(float), -1)) {
+        return 1;
+      }
+      for (int i = 0; i < recvLen; i++) {
+        buf[recvOff + i] += ctx->scratch[i];
+      }
+    } else {
+      if (sendRecvAll(ctx->sendFd, (char*)(buf + sendOff), ((sendC+1) * n / N - sendOff) * sizeof(float),
+                      ctx->recvFd, (char*)(buf + recvOff), recvLen * sizeof(float), -1)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// copies buf of rank 0 to all other ranks
+int distBroadcast(distCtx *ctx, float *buf, int n) {
+  if (ctx->rank != 0) {
+    memset(buf, 0, n * sizeof(float));
+  }
+  return ringAllReduce(ctx, buf, n);
+}
+
+void *distCommLoop(void *arg) {
+  distCtx *ctx = (distCtx*)arg;
+  int b;
+
+  // next to the training thread of the rank, see runDistWorker
+  if (ctx->topo) {
+    numaPinThread(ctx->topo, ctx->numaNode, 2*(ctx->rank / ctx->topo->nNodes) + 1);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  while (true) {
+    while (!ctx->stop && ctx->nReduced == ctx->nQueued) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (ctx->stop) {
+      break;
+    }
+    b = ctx->queue[ctx->nReduced];
+    pthread_mutex_unlock(&ctx->lock);
+
+    int rc = ringAllReduce(ctx, ctx->delta + ctx->bucketStart[b], ctx->bucketEnd[b] - ctx->bucketStart[b]);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (rc) {
+      ctx->err = rc;
+    }
+    ctx->nReduced++;
+    pthread_cond_broadcast(&ctx->cond);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+// update of layer l since the last all-reduce
+void distLayerDelta(distCtx *ctx, int l) {
+  int size = ctx->net->nnLayer[l]->size;
+  float *snapshot = ctx->snapshot + ctx->offset[l];
+  float *delta = ctx->delta + ctx->offset[l];
+  float *weights, *bias;
+
+  distLayerParams(ctx->net, l, &weights, &bias);
+  for (int i = 0; i < size; i++) {
+    delta[i] = weights[i] - snapshot[i];
+    delta[size+i] = bias[i] - snapshot[size+i];
+  }
+}
+
+// makes the params the snapshot plus the averaged update
+void distApplyDelta(distCtx *ctx) {
+  float *weights, *bias;
+  float *snapshot, *delta;
+  int size;
+
+  for (int l = 0; l < ctx->net->nLayer; l++) {
+    size = ctx->net->nnLayer[l]->size;
+    snapshot = ctx->snapshot + ctx->offset[l];
+    delta = ctx->delta + ctx->offset[l];
+    distLayerParams(ctx->net, l, &weights, &bias);
+    for (int i = 0; i < size; i++) {
+      weights[i] = snapshot[i] + delta[i] / ctx->worldSize;
+      bias[i] = snapshot[size+i] + delta[size+i] / ctx->worldSize;
+      snapshot[i] = weights[i];
+      snapshot[size+i] = bias[i];
+    }
+  }
+}
+
+// backpropagate hook, in the last local step before an all-reduce the update of layer l
+// is written to its bucket and completed buckets are handed to the comm thread
+void distOnLayerDone(void *arg, int l) {
+  distCtx *ctx = (distCtx*)arg;
+  int b = ctx->bucketOf[l];
+
+  if ((ctx->step + 1) % ctx->syncInterval != 0) {
+    return;
+  }
+  distLayerDelta(ctx, l);
+  if (--ctx->bucketPending[b] > 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  ctx->queue[ctx->nQueued++] = b;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// ends a local step, every syncInterval steps waits for all buckets to be reduced and applies the averaged update
+int distFinishStep(distCtx *ctx) {
+  ctx->step++;
+  if (ctx->step % ctx->syncInterval != 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->nReduced < ctx->nQueued || (ctx->nQueued < ctx->nBuckets && !ctx->err)) {
+    pthread_cond_wait(&ctx->cond, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  if (ctx->err) {
+    return ctx->err;
+  }
+
+  distApplyDelta(ctx);
+  ctx->nQueued = 0;
+  ctx->nReduced = 0;
+  ctx->step = 0;
+  for (int b = 0; b < ctx->nBuckets; b++) {
+    ctx->bucketPending[b] = ctx->bucketLayers[b];
+  }
+  return 0;
+}
+
+// averages the updates of the local steps which are not yet reduced (e.g. at the end of an iteration)
+// the comm thread is idle in between steps, so the reduction runs on the calling thread
+int distSync(distCtx *ctx) {
+  if (ctx->step == 0) {
+    return 0;
+  }
+  for (int l = 0; l < ctx->net->nLayer; l++) {
+    distLayerDelta(ctx, l);
+  }
+  if (ringAllReduce(ctx, ctx->delta, ctx->nParams)) {
+    return 1;
+  }
+  distApplyDelta(ctx);
+  ctx->step = 0;
+  return 0;
+}
+
+// makes sure that the accepted connection comes from the left neighbour of the same ring
+// (anything may connect to the tcp port)
+int distHandshake(distCtx *ctx) {
+  uint32_t own[3] = {htonl(DIST_MAGIC), htonl(ctx->rank), htonl(ctx->worldSize)};
+  uint32_t peer[3];
+  int left = (ctx->rank - 1 + ctx->worldSize) % ctx->worldSize;
+
+  if (sendRecvAll(ctx->sendFd, (char*)own, sizeof(own), ctx->recvFd, (char*)peer, sizeof(peer), DIST_CONNECT_TIMEOUT_MS)) {
+    fprintf(stderr, "rank %d: no handshake from the left neighbour \n", ctx->rank);
+    return 1;
+  }
+  if (ntohl(peer[0]) != DIST_MAGIC) {
+    fprintf(stderr, "rank %d: unexpected connection on the left \n", ctx->rank);
+    return 1;
+  }
+  if ((int)ntohl(peer[1]) != left || (int)ntohl(peer[2]) != ctx->worldSize) {
+    fprintf(stderr, "rank %d: expected rank %d of %d on the left, got rank %d of %d \n", ctx->rank, left,
+            ctx->worldSize, (int)ntohl(peer[1]), (int)ntohl(peer[2]));
+    return 1;
+  }
+  return 0;
+}
+
+int distConnectRetry(int fd, const struct sockaddr *addr, socklen_t addrLen) {
+  // the neighbour may not be listening yet
+  for (int i = 0; i < DIST_CONNECT_TIMEOUT_MS / 100; i++) {
+    if (connect(fd, addr, addrLen) == 0) {
+      return 0;
+    }
+    if (errno != ENOENT && errno != ECONNREFUSED && errno != EINTR) {
+      return 1;
+    }
+    usleep(100000);
+  }
+  return 1;
+}
+
+// connects the ring, addr is either "unix:<pathPrefix>" (socket of rank r is <pathPrefix>.<r>)
+// or "tcp:<basePort>:<host0>,<host1>,..." (rank r listens on basePort+r)
+int distConnect(distCtx *ctx, const char *addr) {
+  int right = (ctx->rank + 1) % ctx->worldSize;
+  int listenFd = -1;
+  int one = 1;
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+
+    snprintf(ctx->unixPath, sizeof(ctx->unixPath), "%s.%d", addr+5, ctx->rank);
+    strcpy(sa.sun_path, ctx->unixPath);
+    unlink(ctx->unixPath);
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+      return 1;
+    }
+    if (bind(listenFd, (struct sockaddr*)&sa, sizeof(sa)) || listen(listenFd, 1)) {
+      close(listenFd);
+      return 1;
+    }
+
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s.%d", addr+5, right);
+    ctx->sendFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctx->sendFd < 0 || distConnectRetry(ctx->sendFd, (struct sockaddr*)&sa, sizeof(sa))) {
+      close(listenFd);
+      return 1;
+    }
+  } else if (strncmp(addr, "tcp:", 4) == 0) {
+    struct sockaddr_in sa;
+    struct addrinfo hints, *res;
+    char host[256], port[16];
+    int basePort = atoi(addr+4);
+    const char *hosts = strchr(addr+4, ':');
+    int hostLen;
+
+    if (!hosts) {
+      return 1;
+    }
+    hosts++;
+    // picking the host of the right neighbour from the list
+    for (int r = 0; r < right && hosts; r++) {
+      hosts = strchr(hosts, ',');
+      if (hosts) {
+        hosts++;
+      }
+    }
+    if (!hosts) {
+      return 1;
+    }
+    hostLen = strchr(hosts, ',') ? (int)(strchr(hosts, ',') - hosts) : (int)strlen(hosts);
+    if (hostLen >= (int)sizeof(host)) {
+      return 1;
+    }
+    memcpy(host, hosts, hostLen);
+    host[hostLen] = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(basePort + ctx->rank);
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+      return 1;
+    }
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listenFd, (struct sockaddr*)&sa, sizeof(sa)) || listen(listenFd, 1)) {
+      close(listenFd);
+      return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", basePort + right);
+    if (getaddrinfo(host, port, &hints, &res)) {
+      close(listenFd);
+      return 1;
+    }
+    ctx->sendFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ctx->sendFd < 0 || distConnectRetry(ctx->sendFd, res->ai_addr, res->ai_addrlen)) {
+      freeaddrinfo(res);
+      close(listenFd);
+      return 1;
+    }
+    freeaddrinfo(res);
+    setsockopt(ctx->sendFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  } else {
+    return 1;
+  }
+
+  // the left neighbour may not be started yet, but it gets the same time as the connect above
+  struct pollfd pfd;
+  pfd.fd = listenFd;
+  pfd.events = POLLIN;
+  int nReady;
+  do {
+    nReady = poll(&pfd, 1, DIST_CONNECT_TIMEOUT_MS);
+  } while (nReady < 0 && errno == EINTR);
+  ctx->recvFd = nReady > 0 ? accept(listenFd, 0, 0) : -1;
+  close(listenFd);
+  if (ctx->recvFd < 0) {
+    return 1;
+  }
+  if (strncmp(addr, "tcp:", 4) == 0) {
+    setsockopt(ctx->recvFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return distHandshake(ctx);
+}
+
+// also releases a partially initialised ctx
+void distFree(distCtx *ctx) {
+  if (ctx->commStarted) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->commThread, 0);
+    ctx->commStarted = false;
+  }
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->cond);
+
+  ctx->net->onLayerDone = 0;
+  ctx->net->onLayerDoneCtx = 0;
+  free(ctx->offset);
+  free(ctx->bucketOf);
+  free(ctx->bucketStart);
+  free(ctx->bucketEnd);
+  free(ctx->bucketLayers);
+  free(ctx->bucketPending);
+  free(ctx->queue);
+  free(ctx->snapshot);
+  free(ctx->delta);
+  free(ctx->scratch);
+  if (ctx->sendFd >= 0) {
+    close(ctx->sendFd);
+    ctx->sendFd = -1;
+  }
+  if (ctx->recvFd >= 0) {
+    close(ctx->recvFd);
+    ctx->recvFd = -1;
   }
+  if (ctx->unixPath[0]) {
+    unlink(ctx->unixPath);
+    ctx->unixPath[0] = 0;
+  }
+}
+
+// connects to the other ranks and makes the params of all ranks equal to the ones of rank 0
+// if topo is set the step buffers are placed on numaNode
+int distInit(distCtx *ctx, neuralNet *net, int rank, int worldSize, const char *addr, int syncInterval, numaTopo *topo, int numaNode) {
+  int node = topo ? numaNode : -1;
+  int size;
+  float *weights, *bias;
+
+  memset(ctx, 0, sizeof(distCtx));
+  ctx->rank = rank;
+  ctx->worldSize = worldSize;
+  ctx->syncInterval = syncInterval > 0 ? syncInterval : 1;
+  ctx->sendFd = -1;
+  ctx->recvFd = -1;
+  ctx->net = net;
+  ctx->topo = topo;
+  ctx->numaNode = numaNode;
+  pthread_mutex_init(&ctx->lock, 0);
+  pthread_cond_init(&ctx->cond, 0);
+
+  if (worldSize > 1 && distConnect(ctx, addr)) {
+    distFree(ctx);
+    return 1;
+  }
+
+  // layout and buckets in the order backpropagate finishes the layers
+  ctx->offset = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->bucketOf = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->bucketStart = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->bucketEnd = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->bucketLayers = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->bucketPending = (int*)malloc(net->nLayer * sizeof(int));
+  ctx->queue = (int*)malloc(net->nLayer * sizeof(int));
+  for (int l = net->nLayer-1; l >= 0; l--) {
+    if (ctx->nBuckets == 0 || ctx->bucketEnd[ctx->nBuckets-1] - ctx->bucketStart[ctx->nBuckets-1] >= DIST_BUCKET_SIZE) {
+      ctx->bucketStart[ctx->nBuckets] = ctx->nParams;
+      ctx->bucketEnd[ctx->nBuckets] = ctx->nParams;
+      ctx->bucketLayers[ctx->nBuckets] = 0;
+      ctx->nBuckets++;
+    }
+    ctx->offset[l] = ctx->nParams;
+    ctx->nParams += 2 * net->nnLayer[l]->size;
+    ctx->bucketOf[l] = ctx->nBuckets-1;
+    ctx->bucketEnd[ctx->nBuckets-1] = ctx->nParams;
+    ctx->bucketLayers[ctx->nBuckets-1]++;
+  }
+  for (int b = 0; b < ctx->nBuckets; b++) {
+    ctx->bucketPending[b] = ctx->bucketLayers[b];
+  }
+  ctx->snapshot = numaAlloc(topo, ctx->nParams, node);
+  ctx->delta = numaAlloc(topo, ctx->nParams, node);
+  ctx->scratch = numaAlloc(topo, ctx->nParams / worldSize + 1, node);
+  if (ctx->snapshot == 0 || ctx->delta == 0 || ctx->scratch == 0) {
+    distFree(ctx);
+    return 1;
+  }
+
+  for (int l = 0; l < net->nLayer; l++) {
+    size = net->nnLayer[l]->size;
+    if (distBroadcast(ctx, net->nnLayer[l]->weights, size) || distBroadcast(ctx, net->nnLayer[l]->bias, size)) {
+      distFree(ctx);
+      return 1;
+    }
+  }
+  size = net->nnLayer[net->nLayer-1]->size;
+  if (distBroadcast(ctx, net->lastLayerWeight, size) || distBroadcast(ctx, net->lastLayerBias, size)) {
+    distFree(ctx);
+    return 1;
+  }
+  for (int l = 0; l < net->nLayer; l++) {
+    size = net->nnLayer[l]->size;
+    distLayerParams(net, l, &weights, &bias);
+    memcpy(ctx->snapshot + ctx->offset[l], weights, size * sizeof(float));
+    memcpy(ctx->snapshot + ctx->offset[l] + size, bias, size * sizeof(float));
+  }
+
+  if (pthread_create(&ctx->commThread, 0, distCommLoop, ctx)) {
+    distFree(ctx);
+    return 1;
+  }
+  ctx->commStarted = true;
+  net->onLayerDone = distOnLayerDone;
+  net->onLayerDoneCtx = ctx;
   return 0;
 }
 
+// same as trainDNN but training sample k is trained by rank k % worldSize, the ranks
+// step in lockstep so every rank trains the same number of samples per iteration
+// rank 0 runs the evaluator and decides for all ranks when to stop
+int trainDNNDist(neuralNet *net, distCtx *ctx, int nPredict, const char pathToFile[], int iterations, float learningRate, float valFraction, int patience) {
+  dataset train, val;
+  asyncEvaluator eval;
+  float *inp;
+  float error = 0;
+  // summed error and number of trained samples of all ranks, stop flag of rank 0
+  float errStats[3] = {0, 0, 0};
+
+  if (loadDataset(pathToFile, nPredict, valFraction, &train, &val)) {
+    return 1;
+  }
+  int nSteps = train.nSamples / ctx->worldSize;
+  bool evaluate = ctx->rank == 0 && val.nSamples > 0;
+  int evalCore = ctx->topo ? ctx->topo->nCpus[ctx->numaNode]-1 : 0;
+  if (nSteps == 0 || (evaluate && evalInit(&eval, net, &val, patience, ctx->topo, ctx->numaNode, evalCore))) {
+    freeDataset(&train);
+    freeDataset(&val);
+    return 1;
+  }
+
+  int valIteration = -1;
+  float valErr = 0;
+  int rc = 0;
+  for (int i = 0; i < iterations && rc == 0; i++) {
+    for (int s = 0; s < nSteps; s++) {
+      inp = train.samples + (s * ctx->worldSize + ctx->rank) * nPredict;
+
+      backpropagate(net, inp, learningRate);
+      lsErrorCalc(net, inp, &error);
+      if (distFinishStep(ctx)) {
+        rc = 1;
+        break;
+      }
+
+      if (isfinite(error)) {
+        errStats[0] += error;
+      }
+      errStats[1]++;
+    }
+    // the remaining local steps of the iteration, all ranks have the same params afterwards
+    if (rc || distSync(ctx)) {
+      rc = 1;
+      break;
+    }
+
+    if (evaluate && evalPublish(&eval, net, i, &valIteration, &valErr)) {
+      errStats[2] = 1;
+    }
+    if (ringAllReduce(ctx, errStats, 3)) {
+      rc = 1;
+      break;
+    }
+    if (ctx->rank == 0) {
+      printIterationErr(i, errStats[0]/errStats[1], evaluate, valIteration, valErr);
+    }
+    if (errStats[2] > 0) {
+      if (ctx->rank == 0) {
+        printf("early stop after iteration %i \n", i);
+      }
+      break;
+    }
+    errStats[0] = 0;
+    errStats[1] = 0;
+  }
+
+  if (evaluate) {
+    evalFinish(&eval, net);
+    evalFree(&eval);
+  }
+  freeDataset(&train);
+  freeDataset(&val);
+  return rc;
+}
+
+void printUsage() {
+  fprintf(stderr, "usage: simpleNN [numa] \n");
+  fprintf(stderr, "       simpleNN dist <rank> <worldSize> <unix:<pathPrefix> | tcp:<basePort>:<host0>,<host1>,...> [numa] \n");
+  fprintf(stderr, "       simpleNN distLocal <worldSize> [numa] \n");
+}
+
+// with numa set the ranks are spread round robin over the nodes, the training thread and the
+// comm thread of a rank are pinned to two neighbouring cores and all buffers of the rank are node local
+int runDistWorker(neuralNet *net, int rank, int worldSize, const char *addr, bool numa, int nPredict, const char pathToFile[], int iterations, float learningRate, int syncInterval, float valFraction, int patience, float *predSeq) {
+  distCtx ctx;
+  numaTopo topo;
+  int node = -1;
+
+  if (worldSize < 1 || rank < 0 || rank >= worldSize) {
+    fprintf(stderr, "rank has to be in [0, worldSize) and worldSize at least 1 \n");
+    printUsage();
+    return 1;
+  }
+  if (numa) {
+    numaInit(&topo);
+    node = rank % topo.nNodes;
+    numaPinThread(&topo, node, 2*(rank / topo.nNodes));
+    // the net was allocated (and first touched) before the rank was placed
+    numaMoveNet(&topo, net, node);
+  }
+  if (distInit(&ctx, net, rank, worldSize, addr, syncInterval, numa ? &topo : 0, node)) {
+    fprintf(stderr, "rank %d: could not connect the ring \n", rank);
+    if (numa) {
+      numaFree(&topo);
+    }
+    return 1;
+  }
+  int rc = trainDNNDist(net, &ctx, nPredict, pathToFile, iterations, learningRate, valFraction, patience);
+  distFree(&ctx);
+  if (numa) {
+    numaFree(&topo);
+  }
+  if (rc) {
+    fprintf(stderr, "rank %d: training failed \n", rank);
+    return rc;
+  }
+
+  if (rank == 0) {
+    printNN(net);
+    predictDNN(net, predSeq);
+  }
+  return 0;
+}
+
+// forks worldSize workers which are connected over unix domain sockets
+int runDistLocal(neuralNet *net, int worldSize, bool numa, int nPredict, const char pathToFile[], int iterations, float learningRate, int syncInterval, float valFraction, int patience, float *predSeq) {
+  char addr[64];
+  pid_t pid;
+  int status;
+  int rc = 0;
+
+  if (worldSize < 1) {
+    fprintf(stderr, "worldSize has to be at least 1 \n");
+    printUsage();
+    return 1;
+  }
+  snprintf(addr, sizeof(addr), "unix:/tmp/simpleNN.%d", (int)getpid());
+  pid_t *children = (pid_t*)malloc(worldSize * sizeof(pid_t));
+  fflush(stdout);
+  for (int r = 0; r < worldSize; r++) {
+    pid = fork();
+    if (pid < 0) {
+      // the workers already started would wait for the missing ranks
+      for (int c = 0; c < r; c++) {
+        kill(children[c], SIGTERM);
+      }
+      rc = 1;
+      break;
+    }
+    if (pid == 0) {
+      exit(runDistWorker(net, r, worldSize, addr, numa, nPredict, pathToFile, iterations, learningRate, syncInterval, valFraction, patience, predSeq));
+    }
+    children[r] = pid;
+  }
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      rc = 1;
+    }
+  }
+  free(children);
+  return rc;
+}
+
 // TODO -> free memory!!
-int main(){
+// usage: simpleNN [numa]
+//        simpleNN dist <rank> <worldSize> <unix:<pathPrefix> | tcp:<basePort>:<host0>,<host1>,...> [numa]
+//        simpleNN distLocal <worldSize> [numa]
+int main(int argc, char *argv[]){
   int nPredict = 4;
   int iterations = 1;
   float learningRate = 0.000000000001;
+  // local steps of every rank between two all-reduces in the distributed modes
+  int syncInterval = 32;
+  // held out share of the dataset and iterations without validation improvement until the training stops
+  float valFraction = 0.1;
+  int patience = 3;
+  const char *pathToFile = "../data/datasetByLine.csv";
 
   NN_DEBUG_PRINT(("nPredict: %d \n", nPredict));
 
@@ -342,13 +1811,61 @@ int main(){
 
   neuralNet dnn = createNet(layer, 4);
 
-  int rc = trainDNN(&dnn, nPredict, "../data/datasetByLine.csv", iterations, learningRate);
-
   float predSeq[] = {2.6, 2.4, 3.9,  1.3, 2.1};
   // float predSeq[] = {14.6, 18.2, 16.4, 16.6, 14.7};
+
+  bool numa = argc > 1 && strcmp(argv[argc-1], "numa") == 0;
+  if (numa) {
+    argc--;
+  }
+
+  if (argc == 5 && strcmp(argv[1], "dist") == 0) {
+    int rc = runDistWorker(&dnn, atoi(argv[2]), atoi(argv[3]), argv[4], numa, nPredict, pathToFile, iterations, learningRate, syncInterval, valFraction, patience, predSeq);
+    freeNet(&dnn);
+    return rc;
+  }
+  if (argc == 3 && strcmp(argv[1], "distLocal") == 0) {
+    int rc = runDistLocal(&dnn, atoi(argv[2]), numa, nPredict, pathToFile, iterations, learningRate, syncInterval, valFraction, patience, predSeq);
+    freeNet(&dnn);
+    return rc;
+  }
+  if (argc > 1) {
+    printUsage();
+    freeNet(&dnn);
+    return 1;
+  }
+
+  if (numa) {
+    numaTopo topo;
+    numaInit(&topo);
+    numaPinThread(&topo, 0, 0);
+    numaMoveNet(&topo, &dnn, 0);
+
+    int rc = trainDNN(&dnn, nPredict, pathToFile, iterations, learningRate, valFraction, patience, &topo);
+    // inference reads the weights from a replica on every node
+    float predSeqs[] = {2.6, 2.4, 3.9, 1.3, 14.6, 18.2, 16.4, 16.6};
+    if (rc) {
+      fprintf(stderr, "training failed \n");
+    } else {
+      printNN(&dnn);
+      rc = predictDNNNuma(&dnn, &topo, predSeqs, sizeof(predSeqs) / sizeof(float) / nPredict, nPredict);
+    }
+    numaFree(&topo);
+    freeNet(&dnn);
+    return rc;
+  }
+
+  int rc = trainDNN(&dnn, nPredict, pathToFile, iterations, learningRate, valFraction, patience, 0);
+  if (rc) {
+    fprintf(stderr, "training failed \n");
+    freeNet(&dnn);
+    return rc;
+  }
+
   printNN(&dnn);
 
   predictDNN(&dnn, predSeq);
 
   freeNet(&dnn);
+  return 0;
 }